@@ -0,0 +1,380 @@
+// Micro-benchmarks for the intersection kernels and vector helpers of
+// RayTracer.c. The renderer is compiled in with its main() renamed, so each
+// kernel is the same code, built with the same flags, as in the raytrace
+// binary.
+//
+//   kernelbench [repetitions]
+//
+// Each kernel runs over a fixed set of inputs shaped like the ones it sees
+// while rendering. Every input is a primary ray through the view plane
+// aimed near a BVH leaf of four spheres, the way a traversal only tests the
+// leaves whose box the ray enters, along with the leaf's box and a surface
+// normal facing the ray. The sphere kernels are timed for every instruction
+// set this CPU can run. After a few warm-up passes every repetition is
+// timed on its own, and the report gives the nanoseconds per call across
+// repetitions.
+//
+// Before timing, every sphere kernel set is checked against the scalar
+// reference, on the timed rays and on rays that start inside one of the
+// leaf's spheres, and the program exits with an error if any disagree.
+#define main rayTracerMain
+#include "RayTracer.c"
+#undef main
+
+typedef double (*KernelLoop)(KernelSet *set);
+
+typedef struct KernelBenchmark{ // KernelBenchmark (one kernel and the loop that times it)
+  char name[48];
+  KernelLoop loop;
+  KernelSet *set;  // for the sphere kernels, which build to time
+} KernelBenchmark;
+
+
+// Functions
+void fillInputs();
+void checkSphereKernels();
+int checkIntersectSpheres(KernelSet *set, int first, double *origin, double *direction);
+int listBenchmarks();
+void addBenchmark(const char *name, KernelLoop loop, KernelSet *set);
+void randomDirection(double *direction);
+double benchIntersectSpheres(KernelSet *set);
+double benchOccludeSpheres(KernelSet *set);
+double benchSphereOccludes(KernelSet *set);
+double benchRayHitsBox(KernelSet *set);
+double benchUnitVector(KernelSet *set);
+double benchVectorMagnitude(KernelSet *set);
+double benchReflectionVector(KernelSet *set);
+int compareDoubles(const void *double1, const void *double2);
+double randomUniform(double low, double high);
+
+
+// Global Variables
+// Inputs per pass, small enough to stay in L1 so the kernels are timed
+// rather than memory
+#define INPUTCOUNT 1024
+int WARMUPPASSES = 3;
+int REPETITIONS = 30;
+int CALLSPERREPETITION = 1 << 20;
+double rayDirection[INPUTCOUNT][3];    // unnormalized, through the view plane
+double unitDirection[INPUTCOUNT][3];
+double rayOrigin[3] = {0, 0, 0};
+double shadowLength[INPUTCOUNT];       // tMax of the occlusion tests
+BvhNode leafBox[INPUTCOUNT];           // around the four spheres of each leaf
+double hitNormal[INPUTCOUNT][3];       // unit length, facing the ray
+double insideOrigin[INPUTCOUNT][3];    // within one of the leaf's spheres
+double insideDirection[INPUTCOUNT][3]; // unit length, any way
+unsigned long long randomState = 88172645463325252ull;
+KernelBenchmark benchmarks[32];
+int benchmarkCount = 0;
+
+
+int main(int c, char** argv) {
+ if (c > 2) {
+   fprintf(stderr, "Usage: %s [repetitions]\n", argv[0]);
+   exit(1);
+ }
+ if (c == 2) {
+   sscanf(argv[1], "%d", &REPETITIONS);
+   if (REPETITIONS < 1) {
+     fprintf(stderr, "Error: Repetitions must be positive.\n");
+     exit(1);
+   }
+ }
+ fillInputs();
+ checkSphereKernels();
+ listBenchmarks();
+ printf("%d calls per repetition, %d warm-up passes, %d repetitions, ns per call\n",
+        CALLSPERREPETITION, WARMUPPASSES, REPETITIONS);
+ printf("%-28s %9s %9s %9s %9s %7s\n", "kernel", "min", "median", "mean", "stddev", "cv");
+ double *samples = malloc(REPETITIONS * sizeof(double));
+ // Keeps the results live so the loops are not optimized away
+ volatile double sink = 0;
+ int benchmarkIndex;
+ for (benchmarkIndex = 0; benchmarkIndex < benchmarkCount; benchmarkIndex++) {
+   KernelBenchmark *benchmark = &benchmarks[benchmarkIndex];
+   int repetition;
+   for (repetition = 0; repetition < WARMUPPASSES; repetition++) {
+     sink += benchmark->loop(benchmark->set);
+   }
+   double sum = 0;
+   for (repetition = 0; repetition < REPETITIONS; repetition++) {
+     double startTime = wallTime();
+     sink += benchmark->loop(benchmark->set);
+     samples[repetition] = (wallTime() - startTime) * 1e9 / CALLSPERREPETITION;
+     sum += samples[repetition];
+   }
+   double mean = sum / REPETITIONS;
+   double variance = 0;
+   for (repetition = 0; repetition < REPETITIONS; repetition++) {
+     variance += (samples[repetition] - mean) * (samples[repetition] - mean);
+   }
+   double deviation = REPETITIONS > 1 ? sqrt(variance / (REPETITIONS - 1)) : 0;
+   qsort(samples, REPETITIONS, sizeof(double), compareDoubles);
+   double median = REPETITIONS % 2 ? samples[REPETITIONS / 2]
+                                   : (samples[REPETITIONS / 2 - 1] + samples[REPETITIONS / 2]) / 2;
+   printf("%-28s %9.3f %9.3f %9.3f %9.3f %6.1f%%\n", benchmark->name, samples[0], median,
+          mean, deviation, 100 * deviation / mean);
+ }
+ free(samples);
+ return sink == 0.5 ? 1 : 0;
+}
+
+// fillInputs() draws the inputs once, so every kernel and repetition sees
+// the same ones. Input i is a leaf of four spheres, in slots 4i to 4i + 3,
+// clustered somewhere in front of the camera, and a ray aimed close enough
+// to the cluster that it hits some of the spheres and misses others.
+void fillInputs() {
+ primitives.sphereCount = 4 * INPUTCOUNT;
+ // Room for the padding slots the vector kernels may read
+ primitives.sphereX = calloc(primitives.sphereCount + 4, sizeof(double));
+ primitives.sphereY = calloc(primitives.sphereCount + 4, sizeof(double));
+ primitives.sphereZ = calloc(primitives.sphereCount + 4, sizeof(double));
+ primitives.sphereRadiusSquared = calloc(primitives.sphereCount + 4, sizeof(double));
+ int index, slot, axis;
+ for (index = 0; index < INPUTCOUNT; index++) {
+   // Within a 2 x 1.5 view plane at z = 1, as in setupView()
+   double center[3];
+   center[2] = randomUniform(5, 60);
+   center[0] = randomUniform(-1, 1) * center[2];
+   center[1] = randomUniform(-0.75, 0.75) * center[2];
+   BvhNode *box = &leafBox[index];
+   for (axis = 0; axis < 3; axis++) {
+     box->min[axis] = INFINITY;
+     box->max[axis] = -INFINITY;
+   }
+   box->first = 4 * index;
+   box->count = 4;
+   for (slot = 4 * index; slot < 4 * index + 4; slot++) {
+     double position[3];
+     double radius = randomUniform(0.3, 1);
+     position[0] = primitives.sphereX[slot] = center[0] + randomUniform(-1.5, 1.5);
+     position[1] = primitives.sphereY[slot] = center[1] + randomUniform(-1.5, 1.5);
+     position[2] = primitives.sphereZ[slot] = center[2] + randomUniform(-1.5, 1.5);
+     primitives.sphereRadiusSquared[slot] = radius * radius;
+     for (axis = 0; axis < 3; axis++) {
+       if (position[axis] - radius < box->min[axis]) box->min[axis] = position[axis] - radius;
+       if (position[axis] + radius > box->max[axis]) box->max[axis] = position[axis] + radius;
+     }
+   }
+   rayDirection[index][0] = center[0] + randomUniform(-1.5, 1.5);
+   rayDirection[index][1] = center[1] + randomUniform(-1.5, 1.5);
+   rayDirection[index][2] = center[2];
+   vectorDivide(rayDirection[index], rayDirection[index], center[2]);
+   unitVector(rayDirection[index], unitDirection[index]);
+   // Shadow rays to lights in front of, among and behind the spheres
+   shadowLength[index] = center[2] * randomUniform(0.5, 1.5);
+   randomDirection(hitNormal[index]);
+   if (dotProduct(hitNormal[index], unitDirection[index]) > 0) {
+     vectorMultiply(hitNormal[index], hitNormal[index], -1);
+   }
+ }
+ // Rays leaving a point inside one sphere of each leaf, drawn last so the
+ // timed inputs stay the same
+ for (index = 0; index < INPUTCOUNT; index++) {
+   slot = 4 * index + index % 4;
+   double radius = sqrt(primitives.sphereRadiusSquared[slot]);
+   randomDirection(insideOrigin[index]);
+   vectorMultiply(insideOrigin[index], insideOrigin[index], randomUniform(0, 0.9) * radius);
+   insideOrigin[index][0] += primitives.sphereX[slot];
+   insideOrigin[index][1] += primitives.sphereY[slot];
+   insideOrigin[index][2] += primitives.sphereZ[slot];
+   randomDirection(insideDirection[index]);
+ }
+}
+
+// checkSphereKernels() runs every sphere kernel set this CPU supports on
+// the timed rays and on the rays that start inside a sphere, and exits if
+// a set reports different hits or distances from the scalar kernel.
+void checkSphereKernels() {
+ int setCount = sizeof(kernelSets) / sizeof(kernelSets[0]);
+ int setIndex, index;
+ int checked = 0;
+ for (setIndex = 0; setIndex < setCount; setIndex++) {
+   if (!kernelSupported(kernelSets[setIndex].name)) {
+     continue;
+   }
+   for (index = 0; index < INPUTCOUNT; index++) {
+     if (!checkIntersectSpheres(&kernelSets[setIndex], 4 * index, rayOrigin, unitDirection[index]) ||
+         !checkIntersectSpheres(&kernelSets[setIndex], 4 * index, insideOrigin[index], insideDirection[index])) {
+       fprintf(stderr, "Error: The %s sphere kernel disagrees with the scalar kernel, or reports a hit behind the ray, on ray %d.\n",
+               kernelSets[setIndex].name, index);
+       exit(1);
+     }
+   }
+   checked++;
+ }
+ printf("Checked %d sphere kernel sets on %d rays, %d of them starting inside a sphere\n",
+        checked, 2 * INPUTCOUNT, INPUTCOUNT);
+}
+
+// checkIntersectSpheres() compares one call of a kernel set against the
+// scalar kernel. Every hit must match bit for bit and be in front of origin.
+int checkIntersectSpheres(KernelSet *set, int first, double *origin, double *direction) {
+ double expected[4];
+ double tNear[4];
+ int expectedHits = intersectSpheresScalar(first, 4, origin, direction, expected);
+ int hits = set->intersectSpheres(first, 4, origin, direction, tNear);
+ if (hits != expectedHits) {
+   return 0;
+ }
+ int lane;
+ for (lane = 0; lane < 4; lane++) {
+   if ((hits >> lane & 1) && (tNear[lane] != expected[lane] || !(tNear[lane] > 0))) {
+     return 0;
+   }
+ }
+ return 1;
+}
+
+// listBenchmarks() puts the sphere kernels of every instruction set this
+// CPU runs first, then the scalar tests and vector helpers.
+int listBenchmarks() {
+ int setCount = sizeof(kernelSets) / sizeof(kernelSets[0]);
+ int setIndex;
+ char name[48];
+ for (setIndex = 0; setIndex < setCount; setIndex++) {
+   if (!kernelSupported(kernelSets[setIndex].name)) {
+     continue;
+   }
+   snprintf(name, sizeof(name), "intersectSpheres/%s", kernelSets[setIndex].name);
+   addBenchmark(name, benchIntersectSpheres, &kernelSets[setIndex]);
+   snprintf(name, sizeof(name), "occludeSpheres/%s", kernelSets[setIndex].name);
+   addBenchmark(name, benchOccludeSpheres, &kernelSets[setIndex]);
+ }
+ addBenchmark("sphereOccludes", benchSphereOccludes, NULL);
+ addBenchmark("rayHitsBox", benchRayHitsBox, NULL);
+ addBenchmark("unitVector", benchUnitVector, NULL);
+ addBenchmark("vectorMagnitude", benchVectorMagnitude, NULL);
+ addBenchmark("reflectionVector", benchReflectionVector, NULL);
+ return benchmarkCount;
+}
+
+void addBenchmark(const char *name, KernelLoop loop, KernelSet *set) {
+ KernelBenchmark *benchmark = &benchmarks[benchmarkCount++];
+ snprintf(benchmark->name, sizeof(benchmark->name), "%s", name);
+ benchmark->loop = loop;
+ benchmark->set = set;
+}
+
+// randomDirection() picks a uniformly distributed unit vector.
+void randomDirection(double *direction) {
+ double length;
+ do {
+   direction[0] = randomUniform(-1, 1);
+   direction[1] = randomUniform(-1, 1);
+   direction[2] = randomUniform(-1, 1);
+   length = vectorMagnitude(direction);
+ } while (length > 1 || length < 1e-3);
+ vectorDivide(direction, direction, length);
+}
+
+// The sphere kernels test a whole leaf per call, as closestHit() and
+// occluded() do.
+double benchIntersectSpheres(KernelSet *set) {
+ double sum = 0;
+ double tNear[4];
+ int call;
+ for (call = 0; call < CALLSPERREPETITION; call++) {
+   int index = call % INPUTCOUNT;
+   int hits = set->intersectSpheres(4 * index, 4, rayOrigin, unitDirection[index], tNear);
+   sum += hits + (hits & 1 ? tNear[0] : 0);
+ }
+ return sum;
+}
+
+double benchOccludeSpheres(KernelSet *set) {
+ double sum = 0;
+ int call;
+ for (call = 0; call < CALLSPERREPETITION; call++) {
+   int index = call % INPUTCOUNT;
+   sum += set->occludeSpheres(4 * index, 4, rayOrigin, unitDirection[index], shadowLength[index]);
+ }
+ return sum;
+}
+
+double benchSphereOccludes(KernelSet *set) {
+ (void) set;
+ double sum = 0;
+ int call;
+ for (call = 0; call < CALLSPERREPETITION; call++) {
+   int index = call % INPUTCOUNT;
+   sum += sphereOccludes(4 * index + (call / INPUTCOUNT) % 4, rayOrigin, unitDirection[index],
+                         shadowLength[index]);
+ }
+ return sum;
+}
+
+double benchRayHitsBox(KernelSet *set) {
+ (void) set;
+ double sum = 0;
+ double tEnter;
+ int call;
+ for (call = 0; call < CALLSPERREPETITION; call++) {
+   int index = call % INPUTCOUNT;
+   // Every other box is tested against a neighbouring leaf's ray, which
+   // mostly misses it
+   int box = (index + (call / INPUTCOUNT) % 2) % INPUTCOUNT;
+   if (rayHitsBox(&leafBox[box], rayOrigin, unitDirection[index], INFINITY, &tEnter)) {
+     sum += tEnter;
+   }
+ }
+ return sum;
+}
+
+double benchUnitVector(KernelSet *set) {
+ (void) set;
+ double sum = 0;
+ double result[3];
+ int call;
+ for (call = 0; call < CALLSPERREPETITION; call++) {
+   unitVector(rayDirection[call % INPUTCOUNT], result);
+   sum += result[0];
+ }
+ return sum;
+}
+
+double benchVectorMagnitude(KernelSet *set) {
+ (void) set;
+ double sum = 0;
+ int call;
+ for (call = 0; call < CALLSPERREPETITION; call++) {
+   sum += vectorMagnitude(rayDirection[call % INPUTCOUNT]);
+ }
+ return sum;
+}
+
+// benchReflectionVector() passes copies, as the renderer does, since
+// reflectionVector() normalizes its inputs in place.
+double benchReflectionVector(KernelSet *set) {
+ (void) set;
+ double sum = 0;
+ double lightVector[3];
+ double normal[3];
+ double result[3];
+ int call;
+ for (call = 0; call < CALLSPERREPETITION; call++) {
+   int index = call % INPUTCOUNT;
+   memcpy(lightVector, rayDirection[index], sizeof(lightVector));
+   memcpy(normal, hitNormal[index], sizeof(normal));
+   reflectionVector(lightVector, normal, result);
+   sum += result[1];
+ }
+ return sum;
+}
+
+int compareDoubles(const void *double1, const void *double2) {
+ double value1 = *(const double *) double1;
+ double value2 = *(const double *) double2;
+ if (value1 < value2) return -1;
+ if (value1 > value2) return 1;
+ return 0;
+}
+
+// randomUniform() returns a uniform number in [low, high) from a xorshift64*.
+double randomUniform(double low, double high) {
+ randomState ^= randomState >> 12;
+ randomState ^= randomState << 25;
+ randomState ^= randomState >> 27;
+ double unit = ((randomState * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+ return low + (high - low) * unit;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Generates JSON scenes of a controlled size and kind for the benchmarks.
+// The camera sits at the origin looking down positive z, as in RayTracer.c.
+//
+//   scenegen spheres N [seed]   N random spheres over a floor, two lights
+//   scenegen corridor N [seed]  N spheres between two facing mirror walls
+//   scenegen lights N [seed]    a grid of N point lights over a few spheres
+//
+// The same arguments always produce the same file.
+
+
+// Functions
+void writeCamera();
+void writeSphere(double x, double y, double z, double radius, double reflectivity);
+void writePlane(double x, double y, double z, double nx, double ny, double nz,
+                double gray, double reflectivity);
+void writeLight(double x, double y, double z, double red, double green, double blue);
+void writeSeparator();
+double randomUnit();
+
+
+// Global Variables
+unsigned long long seed = 88172645463325252ull;
+int entryCount = 0;
+
+
+int main(int c, char** argv) {
+ if (c < 3 || c > 4) {
+   fprintf(stderr, "Usage: %s spheres|corridor|lights count [seed]\n", argv[0]);
+   exit(1);
+ }
+ char *kind = argv[1];
+ int count = atoi(argv[2]);
+ if (count < 1) {
+   fprintf(stderr, "Error: Count must be positive.\n");
+   exit(1);
+ }
+ if (c == 4) {
+   seed ^= strtoull(argv[3], NULL, 10) * 0x9e3779b97f4a7c15ull;
+ }
+
+ printf("[\n");
+ writeCamera();
+ int index;
+ if (strcmp(kind, "spheres") == 0) {
+   writePlane(0, -4, 0, 0, 1, 0, 0.5, 0);
+   // Fill the view from 5 to 60 units out, keeping the spheres small enough
+   // that most of them stay visible
+   double radius = 6.0 / sqrt(count) + 0.02;
+   for (index = 0; index < count; index++) {
+     double z = 5 + 55 * randomUnit();
+     writeSphere((randomUnit() - 0.5) * z, (randomUnit() - 0.5) * z * 0.75, z,
+                 radius * (0.5 + randomUnit()), randomUnit() < 0.3 ? 0.5 : 0);
+   }
+   writeLight(0, 10, 0, 1.5, 1.5, 1.5);
+   writeLight(-5, 2, 2, 0.8, 0.6, 0.4);
+ }
+ else if (strcmp(kind, "corridor") == 0) {
+   // Facing mirrors bounce every reflected ray until the recursion limit
+   writePlane(-3, 0, 0, 1, 0, 0, 0.2, 0.9);
+   writePlane(3, 0, 0, -1, 0, 0, 0.2, 0.9);
+   writePlane(0, -2, 0, 0, 1, 0, 0.5, 0.2);
+   for (index = 0; index < count; index++) {
+     double z = 4 + 4.0 * index * 40 / count + randomUnit();
+     writeSphere((randomUnit() - 0.5) * 4, (randomUnit() - 0.5) * 2, z,
+                 0.2 + 0.3 * randomUnit(), 0.5);
+   }
+   writeLight(0, 1.5, 2, 1.5, 1.5, 1.5);
+ }
+ else if (strcmp(kind, "lights") == 0) {
+   writePlane(0, -2, 0, 0, 1, 0, 0.5, 0);
+   for (index = 0; index < 9; index++) {
+     writeSphere((index % 3 - 1) * 3, (index / 3 - 1) * 1.5, 10 + randomUnit() * 2, 1, 0.3);
+   }
+   // A square grid of dim lights above the spheres, so the total light
+   // stays about the same whatever the count
+   int side = (int) ceil(sqrt(count));
+   double brightness = 8.0 / count;
+   for (index = 0; index < count; index++) {
+     writeLight((index % side - (side - 1) / 2.0) * 20.0 / side, 8,
+                10 + (index / side - (side - 1) / 2.0) * 20.0 / side,
+                brightness, brightness, brightness);
+   }
+ }
+ else {
+   fprintf(stderr, "Error: Unknown scene kind \"%s\".\n", kind);
+   exit(1);
+ }
+ printf("\n]\n");
+ return 0;
+}
+
+void writeCamera() {
+ writeSeparator();
+ printf("  {\n    \"type\": \"camera\",\n    \"width\": 2.0,\n    \"height\": 1.5\n  }");
+}
+
+void writeSphere(double x, double y, double z, double radius, double reflectivity) {
+ writeSeparator();
+ printf("  {\n    \"type\": \"sphere\",\n");
+ printf("    \"diffuse_color\": [%.6f, %.6f, %.6f],\n", randomUnit(), randomUnit(), randomUnit());
+ printf("    \"specular_color\": [0.3, 0.3, 0.3],\n");
+ printf("    \"position\": [%.6f, %.6f, %.6f],\n", x, y, z);
+ printf("    \"radius\": %.6f,\n", radius);
+ printf("    \"reflectivity\": %.2f\n  }", reflectivity);
+}
+
+void writePlane(double x, double y, double z, double nx, double ny, double nz,
+                double gray, double reflectivity) {
+ writeSeparator();
+ printf("  {\n    \"type\": \"plane\",\n");
+ printf("    \"diffuse_color\": [%.2f, %.2f, %.2f],\n", gray, gray, gray);
+ printf("    \"specular_color\": [0, 0, 0],\n");
+ printf("    \"position\": [%g, %g, %g],\n", x, y, z);
+ printf("    \"normal\": [%g, %g, %g],\n", nx, ny, nz);
+ printf("    \"reflectivity\": %.2f\n  }", reflectivity);
+}
+
+void writeLight(double x, double y, double z, double red, double green, double blue) {
+ writeSeparator();
+ printf("  {\n    \"type\": \"light\",\n");
+ printf("    \"color\": [%.6f, %.6f, %.6f],\n", red, green, blue);
+ printf("    \"theta\": 0,\n    \"radial-a2\": 0.01,\n    \"radial-a1\": 0.05,\n    \"radial-a0\": 0.5,\n");
+ printf("    \"position\": [%.6f, %.6f, %.6f]\n  }", x, y, z);
+}
+
+// writeSeparator() puts a comma between entries.
+void writeSeparator() {
+ if (entryCount++ > 0) {
+   printf(",\n");
+ }
+}
+
+// randomUnit() returns a uniform number in [0, 1) from a xorshift64*.
+double randomUnit() {
+ seed ^= seed >> 12;
+ seed ^= seed << 25;
+ seed ^= seed >> 27;
+ return ((seed * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+# End-to-end benchmark: renders generated scenes at several resolutions and
+# thread counts and prints one tab-separated line per run. Run through
+# `make bench`, which saves the table to bench_output.txt.
+set -e
+
+SCENES="spheres:1000 spheres:30000 corridor:200 lights:64"
+RESOLUTIONS="320x240 1280x960"
+CORES=$(getconf _NPROCESSORS_ONLN)
+THREADS=$(printf '%s\n' 1 4 "$CORES" | awk -v cores="$CORES" '$1 <= cores' | sort -n -u)
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+printf 'scene\twidth\theight\tthreads\twall_seconds\trays_per_second\tpeak_rss_mb\n'
+for scene in $SCENES; do
+  kind=${scene%%:*}
+  count=${scene##*:}
+  ./scenegen "$kind" "$count" > "$WORK/scene.json"
+  for resolution in $RESOLUTIONS; do
+    width=${resolution%%x*}
+    height=${resolution##*x}
+    for threads in $THREADS; do
+      ./raytrace "$width" "$height" "$WORK/scene.json" "$WORK/out.ppm" --format p6 \
+        --threads "$threads" > "$WORK/log.txt"
+      # "... traced A rays and B shadow rays in T s: ..." and
+      # "Finished in W s: ..., peak RSS M MB"
+      awk -v name="$kind-$count" -v width="$width" -v height="$height" -v threads="$threads" '
+        / traced .* rays and .* shadow rays in / {
+          for (i = 1; i <= NF; i++) {
+            if ($i == "traced") rays = $(i + 1)
+            if ($i == "and") shadow = $(i + 1)
+            if ($i == "in") seconds = $(i + 1)
+          }
+        }
+        /^Finished in / { wall = $3; rss = $(NF - 1) }
+        END {
+          printf "%s\t%s\t%s\t%s\t%s\t%.0f\t%s\n", name, width, height, threads,
+                 wall, (rays + shadow) / seconds, rss
+        }' "$WORK/log.txt"
+    done
+  done
+done